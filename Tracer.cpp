@@ -24,14 +24,18 @@ limitations under the License.
 
 // System headers
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <iomanip>
 #include <time.h>
+#include <chrono>
 #if defined(_WIN32) || defined(_WIN64)
 #include <tchar.h>
 #include <atlstr.h>
+#include <io.h>
 #elif defined(__GNUC__)
 #include <sys/stat.h>
+#include <unistd.h>
 #else
 #err PlatformMismatches
 #endif
@@ -58,10 +62,187 @@ Tracer::MediumTypeEnum_t Tracer::m_medium   =
                                               //Tracer::MEDIUM_NETWORK
                                               ;
 
-static TracerMedium* k_tracerMedium         = NULL;
+bool Tracer::m_compress                     = false;
+bool Tracer::m_deferred                     = false;
+
+Tracer::FlushPolicyEnum_t Tracer::m_flushPolicy = Tracer::FLUSH_EVERY_RECORD;
+
+static atomic<TracerMedium*> k_tracerMedium(NULL);
+static mutex         k_tracerMediumGuard;
+static atomic<uint64_t> k_sequence(0);
+
+/// @brief Push the flushed data of the file to the disk
+static void _Sync(FILE* handle)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    _commit(_fileno(handle));
+#else
+    fsync(fileno(handle));
+#endif
+}
+
+#define DEFERRED_LIMIT  (1024 * 1024)  /*1M per thread*/
+#define STAMP_LEN       22             /*"[dd.mm.yyyy hh:mm:ss] " starting every record*/
+#define BLOCK_AGE_MS    200            /*Longest time a record waits in the open block*/
+
+/// @brief Per-thread scratch of the deferred records
+struct TracerScratch {
+    uint32_t depth;      ///< Number of open deferred scopes
+    bool     failed;     ///< An Error occurred, records go straight to the medium
+    string   records;    ///< Captured records, new line terminated
+    vector<uint32_t> sizes;  ///< Size of each captured record
+};
+
+static thread_local TracerScratch k_scratch = {0, false, string(), vector<uint32_t>()};
+
+#define GOVERNOR_WINDOW_MS  250                                      /*Evaluation period*/
+#define GOVERNOR_BACKLOG    (4 * TracerCompressor::BLOCK_SIZE)       /*Backlog counted as pressure*/
+
+/// @brief Levels masked out by the governor, one more entry per step
+static const uint32_t k_shedMasks[] = {
+    0,
+    Tracer::LOG_LEVEL_CALL_TRACE,
+    Tracer::LOG_LEVEL_CALL_TRACE | Tracer::LOG_LEVEL_LOG,
+};
+
+/// @brief State of the load adaptive verbosity
+struct TracerGovernor {
+    atomic<bool>            enabled;      ///< A budget is configured
+    double                  cpuPercent;   ///< Budget of the time share, 0 - no limit
+    uint32_t                rate;         ///< Budget of bytes per second, 0 - no limit
+    uint32_t                step;         ///< Index in k_shedMasks
+    atomic<uint32_t>        shed;         ///< k_shedMasks[step], read by every level check
+    atomic<uint64_t>        printTime;    ///< Nanoseconds spent in Print
+    atomic<uint64_t>        printed;      ///< Records printed in the window
+    atomic<uint64_t>        dropped[3];   ///< Records shed in the window, by the step shedding their level
+    double                  recordCost;   ///< Nanoseconds per printed record, last measured
+    double                  recordBytes;  ///< Bytes per printed record, last measured
+    atomic<int64_t>         windowStart;  ///< Start of the window (steady clock, nanoseconds)
+    uint32_t                generation;   ///< Generation of the medium of the baselines below
+    uint64_t                lastPrint;    ///< printTime at window start
+    uint64_t                lastBusy;     ///< Medium BusyTime at window start
+    uint64_t                lastWritten;  ///< Medium Written at window start
+};
+
+static TracerGovernor    k_governor;
+static mutex             k_governorGuard;
+static atomic<uint32_t>  k_generation(0);
+
+/// @brief Check the level against the configured level and the levels shed by the governor
+static inline bool _Enabled(uint32_t level)
+{
+    return 0 != (Tracer::m_logLevel & level & ~k_governor.shed.load(memory_order_relaxed));
+}
+
+static inline int64_t _Now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// @brief Print a governor record, regardless of the level mask
+static void _Announce(const char* str, ...)
+{
+    va_list strArgList;
+    va_start (strArgList, str);
+    TracerMedium::Instance()->Print(Tracer::LOG_LEVEL_WARNING, "Tracer", "Governor", str, strArgList);
+    va_end (strArgList);
+}
+
+/// @brief Start a new window from the current counters (governor lock must be held)
+static void _Rebase(TracerMedium* medium, int64_t now)
+{
+    k_governor.generation  = medium ? medium->Generation() : 0;
+    k_governor.lastPrint   = k_governor.printTime;
+    k_governor.printed     = 0;
+    for (uint32_t step = 0; step < sizeof(k_shedMasks) / sizeof(k_shedMasks[0]); step++) {
+        k_governor.dropped[step] = 0;
+    }
+    k_governor.lastBusy    = medium ? medium->BusyTime() : 0;
+    k_governor.lastWritten = medium ? medium->Written() : 0;
+    k_governor.windowStart = now;
+}
+
+/// @brief Move to the given shed step and announce it (governor lock must be held)
+static void _Shed(uint32_t step, double cpu, double rate, uint64_t backlog)
+{
+    uint32_t from = Tracer::m_logLevel & ~k_shedMasks[k_governor.step];
+    uint32_t to   = Tracer::m_logLevel & ~k_shedMasks[step];
+    bool reduced  = step > k_governor.step;
+
+    k_governor.step = step;
+    k_governor.shed = k_shedMasks[step];
+    if (from == to) return;
+    _Announce("verbosity %s: level 0x%08X -> 0x%08X (cpu %.2f%%, %.0f B/s, backlog %llu B)",
+        reduced ? "reduced" : "restored", from, to, cpu, rate, static_cast<unsigned long long>(backlog));
+}
+
+/// @brief Evaluate the pressure once per window and adapt the level mask
+static void _Regulate(TracerMedium* medium, int64_t now)
+{
+    if (now - k_governor.windowStart < GOVERNOR_WINDOW_MS * 1000000LL) return;
+
+    unique_lock<mutex> guard(k_governorGuard, try_to_lock);
+    if (!guard.owns_lock() || !k_governor.enabled) return;
+
+    int64_t elapsed = now - k_governor.windowStart;
+    if (elapsed < GOVERNOR_WINDOW_MS * 1000000LL) return;
+    if (medium->Generation() != k_governor.generation) {
+        // Medium changed, its counters start from zero
+        _Rebase(medium, now);
+        return;
+    }
+
+    uint64_t busy    = (k_governor.printTime - k_governor.lastPrint) + (medium->BusyTime() - k_governor.lastBusy);
+    uint64_t written = medium->Written() - k_governor.lastWritten;
+    uint64_t printed = k_governor.printed;
+    double   cpu     = 100.0 * busy / elapsed;
+    double   rate    = 1e9 * written / elapsed;
+    uint64_t backlog = medium->Backlog();
+    if (printed > 0) {
+        k_governor.recordCost  = static_cast<double>(busy) / printed;
+        k_governor.recordBytes = static_cast<double>(written) / printed;
+    }
+
+    bool over  = (k_governor.cpuPercent > 0 && cpu > k_governor.cpuPercent)
+              || (k_governor.rate > 0 && rate > k_governor.rate)
+              || backlog > GOVERNOR_BACKLOG;
+    // Restore only when the records shed by the current step would still fit with a margin,
+    // otherwise the level flaps between the quiet shed window and the loaded restored one
+    double dropped = static_cast<double>(k_governor.dropped[k_governor.step]);
+    double cpuEst  = cpu + 100.0 * dropped * k_governor.recordCost / elapsed;
+    double rateEst = rate + 1e9 * dropped * k_governor.recordBytes / elapsed;
+    bool under = (k_governor.cpuPercent <= 0 || cpuEst < k_governor.cpuPercent * 3 / 4)
+              && (k_governor.rate == 0 || rateEst < k_governor.rate * 3 / 4)
+              && 0 == backlog;
+
+    _Rebase(medium, now);
+
+    if (over && k_governor.step + 1 < sizeof(k_shedMasks) / sizeof(k_shedMasks[0])) {
+        _Shed(k_governor.step + 1, cpu, rate, backlog);
+    } else if (under && k_governor.step > 0) {
+        _Shed(k_governor.step - 1, cpu, rate, backlog);
+    }
+}
+
+/// @brief Count the records shed at the level and keep evaluating the pressure, they never reach print()
+static inline void _Idle(uint32_t level, uint32_t records)
+{
+    uint32_t shed = k_governor.shed.load(memory_order_relaxed);
+    if (!k_governor.enabled || 0 == shed) return;
+
+    if (0 != (Tracer::m_logLevel & level & shed)) {
+        uint32_t step = 1;
+        while (0 == (k_shedMasks[step] & ~k_shedMasks[step - 1] & level)) step++;
+        k_governor.dropped[step] += records;
+    }
+    _Regulate(TracerMedium::Instance(), _Now());
+}
 
 /// TracerMedium ////////////////////////////////////
 TracerMedium::TracerMedium()
+    : m_written(0)
+    , m_busyTime(0)
+    , m_generation(++k_generation)
 {
 
 }
@@ -71,32 +252,103 @@ TracerMedium::~TracerMedium()
 
 }
 
+/// @brief Medium given once the process is exiting, records are dropped
+class TracerMediumClosed : public TracerMedium
+{
+   public:
+      uint64_t Print(Tracer::LogLevelEnum_t, const char*, const char*, const char*, va_list) {return 0;}
+      uint64_t Write(const char*, const uint32_t*, uint32_t) {return 0;}
+      void Flush(uint64_t) {}
+      string Location() const {return "closed";}
+};
+
+static bool k_closed = false;
+
+/// @brief Drain the medium on a normal exit, later records must not open a new one
+static void _Close()
+{
+    {
+        lock_guard<mutex> guard(k_tracerMediumGuard);
+        k_closed = true;
+    }
+    TracerMedium::Destroy();
+}
+
 TracerMedium* TracerMedium::Instance()
 {
-    if (!k_tracerMedium) {
+    // Never freed, records may still come from static destructors
+    static TracerMediumClosed* closed = new TracerMediumClosed();
+    TracerMedium* medium = k_tracerMedium.load();
+    if (medium) return medium;
+
+    // Several threads may log first at the same time, only one creates the medium
+    lock_guard<mutex> guard(k_tracerMediumGuard);
+    static bool registered = false;
+    if (!registered) {
+        // Buffered mediums (compressed file) need to drain on a normal exit
+        atexit(_Close);
+        registered = true;
+    }
+    if (k_closed) return closed;
+    medium = k_tracerMedium.load();
+    if (!medium) {
         switch (Tracer::m_medium) {
-            case Tracer::MEDIUM_CONSOLE: k_tracerMedium = new TracerMediumConsole(); break;
-            case Tracer::MEDIUM_FILE:    k_tracerMedium = new TracerMediumFile(); break;
-            case Tracer::MEDIUM_NETWORK: k_tracerMedium = new TracerMediumNetwork(); break;
+            case Tracer::MEDIUM_CONSOLE: medium = new TracerMediumConsole(); break;
+            case Tracer::MEDIUM_FILE:    medium = new TracerMediumFile(); break;
+            case Tracer::MEDIUM_NETWORK: medium = new TracerMediumNetwork(); break;
         }
+        k_tracerMedium.store(medium);
     }
-    return k_tracerMedium;
+    return medium;
+}
+
+uint64_t TracerMedium::Stamp(uint32_t records)
+{
+    return k_sequence += records;
+}
+
+uint64_t TracerMedium::Last()
+{
+    return k_sequence;
 }
 
 void TracerMedium::Destroy()
 {
-    delete(k_tracerMedium);
-    k_tracerMedium = NULL;
+    lock_guard<mutex> guard(k_tracerMediumGuard);
+    delete(k_tracerMedium.exchange(NULL));
+}
+
+const char* TracerMedium::Prepare(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint32_t &len, uint64_t seq)
+{
+    static char strBuffer [TRACER_RECORD_SIZE] = {'\0'};
+
+    len = Format(strBuffer, sizeof(strBuffer), type, file, func, buf, vaargs, seq) + 1;
+    return strBuffer;
+}
+
+void TracerMedium::Number(string& out, const char* record, uint32_t len, uint64_t seq)
+{
+    char number[32];
+    uint32_t stamp = (len < STAMP_LEN) ? len : STAMP_LEN;
+
+    // The number goes right after the time stamp, as Format puts it
+    sprintf(number, "[#%llu] ", static_cast<unsigned long long>(seq));
+    out.append(record, stamp);
+    out.append(number);
+    out.append(record + stamp, len - stamp);
 }
 
-const char* TracerMedium::Prepare(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint32_t &len)
+uint32_t TracerMedium::Format(char* out, uint32_t size, Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint64_t seq)
 {
-    static char strBuffer [6144 /*6K*/] = {'\0'};
     time_t rawtime;
-    struct tm * timeinfo;
+    struct tm timeinfo;
 
     time(&rawtime);
-    timeinfo = localtime(&rawtime);
+#if defined(_WIN32) || defined(_WIN64)
+    localtime_s(&timeinfo, &rawtime);
+#else
+    localtime_r(&rawtime, &timeinfo);
+#endif
 
     string caption("");
     switch(type) {
@@ -109,19 +361,30 @@ const char* TracerMedium::Prepare(Tracer::LogLevelEnum_t type, const char* file,
         default: break;
     }
 
-    int n = sprintf(strBuffer, "[%02d.%02d.%04d %02d:%02d:%02d] [%s] ",
-        timeinfo->tm_mday, timeinfo->tm_mon + 1, timeinfo->tm_year + 1900, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec,
-        caption.c_str());
+    int n = snprintf(out, size, "[%02d.%02d.%04d %02d:%02d:%02d] ",
+        timeinfo.tm_mday, timeinfo.tm_mon + 1, timeinfo.tm_year + 1900, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
 
-    if (Tracer::LOG_LEVEL_DUMP != type) {
-        n += sprintf(strBuffer+n, "[%s] %s(): ", file, func);
+    if (0 != seq && n >= 0 && static_cast<uint32_t>(n) < size) {
+        n += snprintf(out+n, size-n, "[#%llu] ", static_cast<unsigned long long>(seq));
     }
 
-    n += vsnprintf (strBuffer+n, sizeof(strBuffer)-n, buf, vaargs);
-    strBuffer[n] = '\0';
-    ++n;
-    len = n;
-    return strBuffer;
+    if (n >= 0 && static_cast<uint32_t>(n) < size) {
+        n += snprintf(out+n, size-n, "[%s] ", caption.c_str());
+    }
+
+    if (Tracer::LOG_LEVEL_DUMP != type && n >= 0 && static_cast<uint32_t>(n) < size) {
+        n += snprintf(out+n, size-n, "[%s] %s(): ", file, func);
+    }
+
+    if (n >= 0 && static_cast<uint32_t>(n) < size) {
+        n += vsnprintf (out+n, size-n, buf, vaargs);
+    }
+
+    // Truncated records keep what fits in the buffer
+    if (n < 0) n = 0;
+    if (static_cast<uint32_t>(n) >= size) n = size - 1;
+    out[n] = '\0';
+    return static_cast<uint32_t>(n);
 }
 
 /// TracerMediumConsole ////////////////////////////////////
@@ -135,11 +398,42 @@ TracerMediumConsole::~TracerMediumConsole()
 {
 }
 
-void TracerMediumConsole::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
+uint64_t TracerMediumConsole::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
 {
     uint32_t len = 0;
     TracerMedium::Lock();
-    fprintf(stdout, "%s\n", TracerMedium::Prepare(type, file, func, buf, vaargs, len));
+    uint64_t seq = Stamp();
+    fprintf(stdout, "%s\n", TracerMedium::Prepare(type, file, func, buf, vaargs, len, seq));
+    if (Tracer::FLUSH_EVERY_RECORD == Tracer::m_flushPolicy) {
+        fflush(stdout);
+    }
+    m_written += len;
+    TracerMedium::Unlock();
+    return seq;
+}
+
+uint64_t TracerMediumConsole::Write(const char* data, const uint32_t* sizes, uint32_t records)
+{
+    string   lines;
+    uint64_t seq = 0;
+    TracerMedium::Lock();
+    for (uint32_t it = 0; it < records; ++it) {
+        seq = Stamp();
+        TracerMedium::Number(lines, data, sizes[it], seq);
+        data += sizes[it];
+    }
+    fwrite(lines.data(), 1, lines.size(), stdout);
+    if (Tracer::FLUSH_EVERY_RECORD == Tracer::m_flushPolicy) {
+        fflush(stdout);
+    }
+    m_written += lines.size();
+    TracerMedium::Unlock();
+    return seq;
+}
+
+void TracerMediumConsole::Flush(uint64_t)
+{
+    TracerMedium::Lock();
     fflush(stdout);
     TracerMedium::Unlock();
 }
@@ -147,7 +441,14 @@ void TracerMediumConsole::Print(Tracer::LogLevelEnum_t type, const char* file, c
 /// TracerMediumFile ////////////////////////////////////
 TracerMediumFile::TracerMediumFile()
     : TracerMedium()
+    , m_handle(NULL)
     , m_fileName("")
+    , m_compress(Tracer::m_compress)
+    , m_blockLast(0)
+    , m_stop(false)
+    , m_backlog(0)
+    , m_durable(TracerMedium::Last())
+    , m_synced(TracerMedium::Last())
 {
     time_t rawtime;
     struct tm * timeinfo;
@@ -173,27 +474,200 @@ TracerMediumFile::TracerMediumFile()
         timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 
     m_fileName += fileext;
-    m_handle = fopen(m_fileName.c_str(), "a");
+    if (m_compress) {
+        m_fileName += ".akz";
+    }
+    m_handle = fopen(m_fileName.c_str(), m_compress ? "ab" : "a");
     if (!m_handle) {
         cout << "Failed to open a log file: " << m_fileName.c_str() << endl;
+    } else if (m_compress) {
+        m_block.reserve(TracerCompressor::MAX_BLOCK_SIZE);
+        m_worker = thread(&TracerMediumFile::Worker, this);
     }
 }
 
 TracerMediumFile::~TracerMediumFile()
 {
+    if (m_worker.joinable()) {
+        TracerMedium::Lock();
+        Submit();
+        TracerMedium::Unlock();
+        {
+            lock_guard<mutex> guard(m_queueGuard);
+            m_stop = true;
+        }
+        m_signal.notify_one();
+        m_worker.join();
+    }
     if (m_handle) {
         fclose(m_handle);
     }
 }
 
-void TracerMediumFile::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
+uint64_t TracerMediumFile::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
 {
     uint32_t len = 0;
+    uint64_t seq = 0;
     if (m_handle) {
         TracerMedium::Lock();
-        fprintf(m_handle, "%s\n", TracerMedium::Prepare(type, file, func, buf, vaargs, len));
-        fflush(m_handle);
+        seq = Stamp();
+        const char* line = TracerMedium::Prepare(type, file, func, buf, vaargs, len, seq);
+        if (m_compress) {
+            m_block.append(line);
+            m_block.append(1, '\n');
+            m_blockLast = seq;
+            if (m_block.size() >= TracerCompressor::BLOCK_SIZE) {
+                Submit();
+            }
+        } else {
+            fprintf(m_handle, "%s\n", line);
+            if (Tracer::FLUSH_EVERY_RECORD == Tracer::m_flushPolicy) {
+                fflush(m_handle);
+                m_durable = seq;
+            }
+            m_written += len;
+        }
+        TracerMedium::Unlock();
+    }
+    return seq;
+}
+
+uint64_t TracerMediumFile::Write(const char* data, const uint32_t* sizes, uint32_t records)
+{
+    uint64_t seq = 0;
+    if (m_handle) {
+        TracerMedium::Lock();
+        if (m_compress) {
+            // Released deferred context can be far larger than a block, cut it on record boundaries
+            for (uint32_t it = 0; it < records; ++it) {
+                seq = Stamp();
+                TracerMedium::Number(m_block, data, sizes[it], seq);
+                data += sizes[it];
+                m_blockLast = seq;
+                if (m_block.size() >= TracerCompressor::BLOCK_SIZE) {
+                    Submit();
+                }
+            }
+        } else {
+            string lines;
+            for (uint32_t it = 0; it < records; ++it) {
+                seq = Stamp();
+                TracerMedium::Number(lines, data, sizes[it], seq);
+                data += sizes[it];
+            }
+            fwrite(lines.data(), 1, lines.size(), m_handle);
+            if (Tracer::FLUSH_EVERY_RECORD == Tracer::m_flushPolicy) {
+                fflush(m_handle);
+                m_durable = seq;
+            }
+            m_written += lines.size();
+        }
+        TracerMedium::Unlock();
+    }
+    return seq;
+}
+
+void TracerMediumFile::Flush(uint64_t seq)
+{
+    if (!m_handle) return;
+
+    uint64_t durable = 0;
+    TracerMedium::Lock();
+    // Nothing beyond the last stamped record can be waited for
+    if (seq > TracerMedium::Last()) seq = TracerMedium::Last();
+    if (!m_compress) {
+        if (seq > m_durable) {
+            fflush(m_handle);
+            m_durable = TracerMedium::Last();
+        }
+        durable = m_durable;
+        TracerMedium::Unlock();
+    } else {
+        // Records of the barrier may still be in the block being filled
+        Submit();
         TracerMedium::Unlock();
+
+        unique_lock<mutex> guard(m_queueGuard);
+        while (m_durable < seq) {
+            m_flushed.wait(guard);
+        }
+        durable = m_durable;
+    }
+
+    // Flushed records (FLUSH_EVERY_RECORD, earlier barriers) may still be in the system cache only,
+    // the disk sync is slow so it is left outside of the locks
+    if (Tracer::FLUSH_ON_BARRIER_SYNC == Tracer::m_flushPolicy && seq > m_synced) {
+        _Sync(m_handle);
+        uint64_t synced = m_synced;
+        while (synced < durable && !m_synced.compare_exchange_weak(synced, durable)) {}
+    }
+}
+
+void TracerMediumFile::Submit()
+{
+    if (m_block.empty()) return;
+    {
+        lock_guard<mutex> guard(m_queueGuard);
+        m_backlog += m_block.size();
+        m_pending.push_back(Block());
+        m_pending.back().data.swap(m_block);
+        m_pending.back().last = m_blockLast;
+    }
+    m_block.reserve(TracerCompressor::MAX_BLOCK_SIZE);
+    m_signal.notify_one();
+}
+
+void TracerMediumFile::Worker()
+{
+    string   raw;
+    uint64_t last = 0;
+    uint8_t  hdr[TracerCompressor::HEADER_SIZE];
+    vector<uint8_t> packed;
+
+    for (;;) {
+        {
+            unique_lock<mutex> guard(m_queueGuard);
+            while (m_pending.empty() && !m_stop) {
+                if (cv_status::timeout == m_signal.wait_for(guard, chrono::milliseconds(BLOCK_AGE_MS))) {
+                    // Quiet period, write the partial block instead of waiting for it to fill
+                    guard.unlock();
+                    TracerMedium::Lock();
+                    Submit();
+                    TracerMedium::Unlock();
+                    guard.lock();
+                }
+            }
+            if (m_pending.empty()) break;
+            raw.swap(m_pending.front().data);
+            last = m_pending.front().last;
+            m_pending.pop_front();
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        uint32_t rawLen    = static_cast<uint32_t>(raw.size());
+        // Only a payload smaller than the raw block is worth keeping
+        packed.resize(rawLen);
+        uint32_t packedLen = TracerCompressor::Compress(reinterpret_cast<const uint8_t*>(raw.data()), rawLen, packed.data(), rawLen - 1);
+        const uint8_t* payload = packed.data();
+        if (0 == packedLen) {
+            // Not compressible, store the block as it is
+            packedLen = rawLen;
+            payload   = reinterpret_cast<const uint8_t*>(raw.data());
+        }
+        TracerCompressor::WriteHeader(hdr, rawLen, packedLen);
+        fwrite(hdr, 1, sizeof(hdr), m_handle);
+        fwrite(payload, 1, packedLen, m_handle);
+        fflush(m_handle);
+        m_written  += sizeof(hdr) + packedLen;
+        m_backlog  -= rawLen;
+        m_busyTime += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        raw.clear();
+
+        {
+            lock_guard<mutex> guard(m_queueGuard);
+            m_durable = last;
+        }
+        m_flushed.notify_all();
     }
 }
 
@@ -212,20 +686,196 @@ TracerMediumNetwork::~TracerMediumNetwork()
    // TODO:
 }
 
-void TracerMediumNetwork::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
+uint64_t TracerMediumNetwork::Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs)
+{
+   // TODO:
+   return 0;
+}
+
+uint64_t TracerMediumNetwork::Write(const char*, const uint32_t*, uint32_t)
+{
+   // TODO:
+   return 0;
+}
+
+void TracerMediumNetwork::Flush(uint64_t)
 {
    // TODO:
 }
 
+/// TracerCompressor ////////////////////////////////////
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    12
+#define LZ_MAX_OFFSET   65535
+#define LZ_LAST_LITERALS 5
+
+static inline uint32_t _Read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint8_t* _WriteLength(uint8_t* op, uint32_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+uint32_t TracerCompressor::Compress(const uint8_t* src, uint32_t srcLen, uint8_t* dst, uint32_t dstCap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint32_t ip     = 0;
+    uint32_t anchor = 0;
+    uint8_t* op     = dst;
+    uint8_t* oend   = dst + dstCap;
+
+    memset(table, 0, sizeof(table));
+
+    if (srcLen > LZ_MIN_MATCH + LZ_LAST_LITERALS + 3) {
+        uint32_t limit = srcLen - (LZ_MIN_MATCH + LZ_LAST_LITERALS + 3);
+        while (ip < limit) {
+            uint32_t seq = _Read32(src + ip);
+            uint32_t h   = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+            uint32_t ref = table[h];
+            table[h] = ip;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || _Read32(src + ref) != seq) {
+                ++ip;
+                continue;
+            }
+
+            uint32_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < srcLen - LZ_LAST_LITERALS && src[ref + mlen] == src[ip + mlen]) {
+                ++mlen;
+            }
+
+            // Token, literals, offset and match length must fit
+            uint32_t lit = ip - anchor;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 > oend) return 0;
+
+            uint8_t* token = op++;
+            *token = static_cast<uint8_t>((lit < 15 ? lit : 15) << 4);
+            if (lit >= 15) op = _WriteLength(op, lit - 15);
+            memcpy(op, src + anchor, lit);
+            op += lit;
+
+            uint32_t offset = ip - ref;
+            *op++ = static_cast<uint8_t>(offset & 0xFF);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+
+            uint32_t ml = mlen - LZ_MIN_MATCH;
+            *token |= static_cast<uint8_t>(ml < 15 ? ml : 15);
+            if (ml >= 15) op = _WriteLength(op, ml - 15);
+
+            ip    += mlen;
+            anchor = ip;
+        }
+    }
+
+    // Last literals
+    uint32_t lit = srcLen - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend) return 0;
+    uint8_t* token = op++;
+    *token = static_cast<uint8_t>((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = _WriteLength(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+
+    return static_cast<uint32_t>(op - dst);
+}
+
+int32_t TracerCompressor::Decompress(const uint8_t* src, uint32_t srcLen, uint8_t* dst, uint32_t dstCap)
+{
+    uint32_t ip = 0;
+    uint32_t op = 0;
+
+    while (ip < srcLen) {
+        uint8_t  token = src[ip++];
+        uint32_t lit   = token >> 4;
+        if (15 == lit) {
+            uint8_t b;
+            do {
+                if (ip >= srcLen) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (255 == b);
+        }
+        if (lit > srcLen - ip || lit > dstCap - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == srcLen) break;
+
+        if (srcLen - ip < 2) return -1;
+        uint32_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (0 == offset || offset > op) return -1;
+
+        uint32_t mlen = token & 0x0F;
+        if (15 == mlen) {
+            uint8_t b;
+            do {
+                if (ip >= srcLen) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (255 == b);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > dstCap - op) return -1;
+
+        // Byte wise copy, the match may overlap the output
+        const uint8_t* ref = dst + op - offset;
+        for (uint32_t it = 0; it < mlen; ++it) {
+            dst[op + it] = ref[it];
+        }
+        op += mlen;
+    }
+    return static_cast<int32_t>(op);
+}
+
+void TracerCompressor::WriteHeader(uint8_t* hdr, uint32_t rawLen, uint32_t packedLen)
+{
+    memcpy(hdr, "AKZ1", 4);
+    for (int it = 0; it < 4; ++it) {
+        hdr[4 + it] = static_cast<uint8_t>(rawLen >> (8 * it));
+        hdr[8 + it] = static_cast<uint8_t>(packedLen >> (8 * it));
+    }
+}
+
+bool TracerCompressor::ReadHeader(const uint8_t* hdr, uint32_t &rawLen, uint32_t &packedLen)
+{
+    if (0 != memcmp(hdr, "AKZ1", 4)) return false;
+    rawLen    = 0;
+    packedLen = 0;
+    for (int it = 0; it < 4; ++it) {
+        rawLen    |= static_cast<uint32_t>(hdr[4 + it]) << (8 * it);
+        packedLen |= static_cast<uint32_t>(hdr[8 + it]) << (8 * it);
+    }
+    return true;
+}
+
 /// Tracer ////////////////////////////////////
 Tracer::Tracer()
+    : m_deferredScope(false)
 {
 }
 
 Tracer::~Tracer()
 {
-    if (!(m_logLevel&LOG_LEVEL_CALL_TRACE)) return;
-    if (this->m_enableCalltrace) calltrace("exit");
+    if (_Enabled(LOG_LEVEL_CALL_TRACE) && this->m_enableCalltrace) calltrace("exit");
+
+    if (this->m_deferredScope && 0 == --k_scratch.depth) {
+        // Outermost scope ended, nothing failed since the last Error
+        k_scratch.records.clear();
+        k_scratch.sizes.clear();
+        k_scratch.failed = false;
+    }
 }
 
 Tracer::Tracer(const char * File, const char *Func, int Line, bool needEntryExit)
@@ -238,64 +888,149 @@ Tracer::Tracer(const char * File, const char *Func, int Line, bool needEntryExit
         this->m_file += len;
     }
     this->m_enableCalltrace = needEntryExit;
-    if (!(m_logLevel&LOG_LEVEL_CALL_TRACE)) return;
+    this->m_deferredScope = m_deferred;
+    if (this->m_deferredScope) ++k_scratch.depth;
+    if (!_Enabled(LOG_LEVEL_CALL_TRACE)) {
+        // Entry and exit records
+        _Idle(LOG_LEVEL_CALL_TRACE, this->m_enableCalltrace ? 2 : 0);
+        return;
+    }
     if (this->m_enableCalltrace) calltrace("entry");
 }
 
 void Tracer::calltrace(const char * str,...)
 {
-    if (!(m_logLevel&LOG_LEVEL_CALL_TRACE)) return;
+    if (!_Enabled(LOG_LEVEL_CALL_TRACE)) return;
 
     va_list strArgList;
     va_start (strArgList, str);
-    TracerMedium::Instance()->Print(LOG_LEVEL_CALL_TRACE, this->m_file, this->m_func, str, strArgList);
+    if (!defer(LOG_LEVEL_CALL_TRACE, str, strArgList)) {
+        print(LOG_LEVEL_CALL_TRACE, str, strArgList);
+    }
     va_end (strArgList);
 }
 
-void Tracer::Log(const char * str,...)
+uint64_t Tracer::print(LogLevelEnum_t type, const char * str, va_list vaargs)
 {
-    if (!(m_logLevel&LOG_LEVEL_LOG)) return;
+    TracerMedium* medium = TracerMedium::Instance();
+    if (!k_governor.enabled) {
+        return medium->Print(type, this->m_file, this->m_func, str, vaargs);
+    }
+
+    int64_t start = _Now();
+    uint64_t seq = medium->Print(type, this->m_file, this->m_func, str, vaargs);
+    int64_t end = _Now();
+    k_governor.printTime += end - start;
+    k_governor.printed++;
+    _Regulate(medium, end);
+    return seq;
+}
+
+/// @brief Format the record at the end of the per-thread scratch buffer
+static void _Capture(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* str, va_list vaargs)
+{
+    char record[TRACER_RECORD_SIZE];
+    uint32_t len = TracerMedium::Format(record, sizeof(record) - 1, type, file, func, str, vaargs);
+    record[len++] = '\n';
+
+    string &records = k_scratch.records;
+    vector<uint32_t> &sizes = k_scratch.sizes;
+    if (records.size() + len > DEFERRED_LIMIT) {
+        // Keep the most recent half of the context
+        size_t drop = 0, count = 0;
+        while (count < sizes.size() && drop < records.size() / 2) {
+            drop += sizes[count++];
+        }
+        records.erase(0, drop);
+        sizes.erase(sizes.begin(), sizes.begin() + count);
+    }
+    records.append(record, len);
+    sizes.push_back(len);
+}
+
+bool Tracer::defer(LogLevelEnum_t type, const char * str, va_list vaargs)
+{
+    if (!this->m_deferredScope || k_scratch.failed) return false;
+
+    _Capture(type, this->m_file, this->m_func, str, vaargs);
+    return true;
+}
+
+uint64_t Tracer::Log(const char * str,...)
+{
+    if (!_Enabled(LOG_LEVEL_LOG)) {
+        _Idle(LOG_LEVEL_LOG, 1);
+        return 0;
+    }
 
+    uint64_t seq = 0;
     va_list strArgList;
     va_start (strArgList, str);
-    TracerMedium::Instance()->Print(LOG_LEVEL_LOG, this->m_file, this->m_func, str, strArgList);
+    if (!defer(LOG_LEVEL_LOG, str, strArgList)) {
+        seq = print(LOG_LEVEL_LOG, str, strArgList);
+    }
     va_end (strArgList);
+    return seq;
 }
 
 
-void Tracer::Error(const char * str,...)
+uint64_t Tracer::Error(const char * str,...)
 {
-    if (!(m_logLevel&LOG_LEVEL_ERROR)) return;
-
+    uint64_t seq = 0;
     va_list strArgList;
+
+    // Any Tracer of the thread releases the context of the enclosing deferred scopes
+    if (k_scratch.depth > 0 && !k_scratch.failed) {
+        // Rest of the scope is printed as it comes
+        k_scratch.failed = true;
+        if (!k_scratch.records.empty()) {
+            // Context and error line go in one write, records of other threads cannot split them
+            bool error = _Enabled(LOG_LEVEL_ERROR);
+            if (error) {
+                va_start (strArgList, str);
+                _Capture(LOG_LEVEL_ERROR, this->m_file, this->m_func, str, strArgList);
+                va_end (strArgList);
+            }
+            seq = TracerMedium::Instance()->Write(k_scratch.records.data(), k_scratch.sizes.data(), static_cast<uint32_t>(k_scratch.sizes.size()));
+            k_scratch.records.clear();
+            k_scratch.sizes.clear();
+            return error ? seq : 0;
+        }
+    }
+
+    if (!_Enabled(LOG_LEVEL_ERROR)) return 0;
+
     va_start (strArgList, str);
-    TracerMedium::Instance()->Print(LOG_LEVEL_ERROR, this->m_file, this->m_func, str, strArgList);
+    seq = print(LOG_LEVEL_ERROR, str, strArgList);
     va_end (strArgList);
+    return seq;
 }
 
-void Tracer::Warn(const char * str,...)
+uint64_t Tracer::Warn(const char * str,...)
 {
-    if (!(m_logLevel&LOG_LEVEL_WARNING)) return;
+    if (!_Enabled(LOG_LEVEL_WARNING)) return 0;
 
     va_list strArgList;
     va_start (strArgList, str);
-    TracerMedium::Instance()->Print(LOG_LEVEL_WARNING, this->m_file, this->m_func, str, strArgList);
+    uint64_t seq = print(LOG_LEVEL_WARNING, str, strArgList);
     va_end (strArgList);
+    return seq;
 }
 
-void Tracer::NotImplemented(const char * args,...)
+uint64_t Tracer::NotImplemented(const char * args,...)
 {
-    if (m_logLevel == LOG_LEVEL_NONE) return;
+    if (m_logLevel == LOG_LEVEL_NONE) return 0;
 
     va_list strArgList;
     va_start (strArgList, args);
-    TracerMedium::Instance()->Print(LOG_LEVEL_NOT_IMPLEMENTED, this->m_file, this->m_func, args, strArgList);
+    uint64_t seq = print(LOG_LEVEL_NOT_IMPLEMENTED, args, strArgList);
     va_end (strArgList);
+    return seq;
 }
 
-void Tracer::NotImplemented()
+uint64_t Tracer::NotImplemented()
 {
-    NotImplemented("");
+    return NotImplemented("");
 }
 
 void Tracer::SetLevel(LogLevelEnum_t level)
@@ -309,6 +1044,51 @@ void Tracer::SetMedium(MediumTypeEnum_t medium)
     TracerMedium::Destroy();
 }
 
+void Tracer::SetCompression(bool enable)
+{
+    m_compress = enable;
+    TracerMedium::Destroy();
+}
+
+void Tracer::SetDeferred(bool enable)
+{
+    m_deferred = enable;
+}
+
+void Tracer::SetBudget(double cpuPercent, uint32_t bytesPerSecond)
+{
+    lock_guard<mutex> guard(k_governorGuard);
+    k_governor.cpuPercent = cpuPercent;
+    k_governor.rate       = bytesPerSecond;
+    k_governor.enabled    = (cpuPercent > 0 || bytesPerSecond > 0);
+    _Rebase(k_tracerMedium.load(), _Now());
+
+    if (!k_governor.enabled && k_governor.step > 0) {
+        _Shed(0, 0, 0, 0);
+    }
+}
+
+void Tracer::SetFlushPolicy(FlushPolicyEnum_t policy)
+{
+    m_flushPolicy = policy;
+}
+
+uint64_t Tracer::Sequence()
+{
+    return TracerMedium::Last();
+}
+
+void Tracer::FlushUntil(uint64_t seq)
+{
+    if (0 == seq) return;
+    TracerMedium::Instance()->Flush(seq);
+}
+
+void Tracer::Flush()
+{
+    FlushUntil(Sequence());
+}
+
 void Tracer::HexDump(const char* title, const uint8_t* addr, uint32_t len, uint8_t column)
 {
     printf("\n");
@@ -33,6 +33,11 @@ limitations under the License.
 #include <stdarg.h>
 #include <stdint.h>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
 
 // User headers
 
@@ -45,6 +50,9 @@ namespace Log {
 
 #define DELIMITER "*"
 
+#define TRACER_RECORD_SIZE  6144  /*6K, largest formatted record including the new line*/
+#define TRACER_NUMBER_SIZE  24    /*"[#n] " with the largest 64 bit n, added to the deferred records*/
+
 /**
  *  A Tracer class. It is used to control the debug prints
  */
@@ -69,10 +77,18 @@ class Tracer {
          MEDIUM_NETWORK              = 0x00000002,          ///< Print the log in network
       } MediumTypeEnum_t;
 
+      /// @brief When the medium pushes the records to the disk
+      typedef enum {
+         FLUSH_EVERY_RECORD          = 0x00000000,          ///< Flush after every record (every block, at most 200 ms old, when compressed)
+         FLUSH_ON_BARRIER            = 0x00000001,          ///< Flush only in Flush()/FlushUntil()
+         FLUSH_ON_BARRIER_SYNC       = 0x00000002,          ///< Flush and fsync only in Flush()/FlushUntil()
+      } FlushPolicyEnum_t;
+
    private:
       const char * m_func;
       const char * m_file;
       bool         m_enableCalltrace;
+      bool         m_deferredScope;   ///< Scope was opened in deferred mode
 
       /// @brief Constructor
       Tracer();
@@ -93,6 +109,20 @@ class Tracer {
       /// @return none
       void calltrace(const char * str,...);
 
+      /// @brief To keep the record in the per-thread scratch buffer in deferred mode
+      /// @param[in] type - Log level
+      /// @param[in] str - format specifier
+      /// @param[in] vaargs - Argument list
+      /// @return true when the record was captured and should not be printed now
+      bool defer(LogLevelEnum_t type, const char * str, va_list vaargs);
+
+      /// @brief To print the record in the medium, accounting its cost when a budget is set
+      /// @param[in] type - Log level
+      /// @param[in] str - format specifier
+      /// @param[in] vaargs - Argument list
+      /// @return Sequence number of the record
+      uint64_t print(LogLevelEnum_t type, const char * str, va_list vaargs);
+
    public:
       /// @brief Construct a new Tracer object
       /// @param[in] File - Name of the file
@@ -107,30 +137,30 @@ class Tracer {
       /// @brief API to print log trace
       /// @param[in] str - format specifier 
       /// @param[in] ... - variable arguments
-      /// @return none
-      void Log(const char * str,...);
+      /// @return Sequence number of the record, 0 when it is not written (filtered or deferred)
+      uint64_t Log(const char * str,...);
 
       /// @brief API to print error trace
       /// @param[in] str - format specifier 
       /// @param[in] ... - variable arguments
-      /// @return none
-      void Error(const char * str,...);
+      /// @return Sequence number of the record, 0 when it is not written (filtered or deferred)
+      uint64_t Error(const char * str,...);
 
       /// @brief API to print warn trace
       /// @param[in] str - format specifier 
       /// @param[in] ... - variable arguments
-      /// @return none
-      void Warn(const char * str,...);
+      /// @return Sequence number of the record, 0 when it is not written (filtered or deferred)
+      uint64_t Warn(const char * str,...);
 
       /// @brief API to print not implemented trace
       /// @param[in] args - format specifier 
       /// @param[in] ... - variable arguments
-      /// @return none
-      void NotImplemented(const char * args,...);
+      /// @return Sequence number of the record, 0 when it is not written
+      uint64_t NotImplemented(const char * args,...);
 
       /// @brief API to print not implemented trace
-      /// @return none
-      void NotImplemented();
+      /// @return Sequence number of the record, 0 when it is not written
+      uint64_t NotImplemented();
 
       /// @brief To enable/configure the log level
       /// @param[in] level - config level
@@ -142,6 +172,50 @@ class Tracer {
       /// @return none
       static void SetMedium(MediumTypeEnum_t medium = MEDIUM_CONSOLE);
 
+      /// @brief To enable/disable the block compression of the file medium
+      ///        A block is written once it is full or at most 200 ms after its first record,
+      ///        so an abnormal exit loses up to the last 200 ms of records.
+      /// @param[in] enable - true to write compressed blocks (applies to the next medium instance)
+      /// @return none
+      static void SetCompression(bool enable = false);
+
+      /// @brief To enable/disable the deferred logging.
+      ///        Log and calltrace records of a scope (and its nested scopes on the same thread)
+      ///        are kept in a per-thread buffer, printed only when an Error occurs and
+      ///        discarded when the outermost scope ends without one.
+      /// @param[in] enable - true to defer the records (applies to the scopes opened afterwards)
+      /// @return none
+      static void SetDeferred(bool enable = false);
+
+      /// @brief To limit the cost of the logging.
+      ///        When the time spent in printing, the written bytes or the medium backlog go over
+      ///        the budget, the call trace and then the log levels are masked out. They are
+      ///        restored once the records they shed would fit in three quarters of the budget.
+      ///        Every change is printed as a warning record.
+      /// @param[in] cpuPercent - Allowed share of the wall time spent in logging (0 - no limit)
+      /// @param[in] bytesPerSecond - Allowed write rate of the medium (0 - no limit)
+      /// @return none
+      static void SetBudget(double cpuPercent = 0, uint32_t bytesPerSecond = 0);
+
+      /// @brief To configure when the records are pushed to the disk
+      /// @param[in] policy - flush policy
+      /// @return none
+      static void SetFlushPolicy(FlushPolicyEnum_t policy = FLUSH_EVERY_RECORD);
+
+      /// @brief To get the sequence number of the last record given to the medium
+      /// @return sequence number, 0 when nothing was written yet
+      static uint64_t Sequence();
+
+      /// @brief Wait until every record up to the given sequence number is written
+      ///        (and synced with FLUSH_ON_BARRIER_SYNC)
+      /// @param[in] seq - sequence number returned by Log, Error, ...
+      /// @return none
+      static void FlushUntil(uint64_t seq);
+
+      /// @brief Wait until every record given so far is written
+      /// @return none
+      static void Flush();
+
       /// @brief Hex dump of the given raw buffer
       /// @param[in] title - Title to print above the Dump
       /// @param[in] addr - Address to dump
@@ -150,8 +224,62 @@ class Tracer {
       /// @return none
       static void HexDump(const char* title, const uint8_t* addr, uint32_t len, uint8_t column = 32);
 
-      static LogLevelEnum_t     m_logLevel;     ///< Log level
+      static LogLevelEnum_t     m_logLevel;     ///< Log level (SetBudget may mask levels out on top of it)
       static MediumTypeEnum_t   m_medium;       ///< Log medium
+      static bool               m_compress;     ///< File medium writes compressed blocks
+      static bool               m_deferred;     ///< Log/calltrace records are deferred until an Error
+      static FlushPolicyEnum_t  m_flushPolicy;  ///< When the medium flushes
+};
+
+/**
+ *  A TracerCompressor class. It is a self-contained LZ block compressor used by the file medium.
+ *
+ *  Every block is written as a 12 byte header followed by the payload:
+ *  magic "AKZ1", raw size and payload size (both 32 bit little endian).
+ *  When the payload size equals the raw size, the block is stored uncompressed.
+ *  Blocks are independent, so a reader can seek to any header and decode from there.
+ */
+class TracerCompressor
+{
+   public:
+      static const uint32_t BLOCK_SIZE     = 64 * 1024;                          ///< Raw size of a full block
+      static const uint32_t MAX_BLOCK_SIZE = BLOCK_SIZE + TRACER_RECORD_SIZE + TRACER_NUMBER_SIZE;  ///< A block is cut after the record which fills it
+      static const uint32_t HEADER_SIZE    = 12;                                 ///< Size of the block header
+
+      /// @brief Worst case payload size for the given raw size
+      /// @param[in] len - Raw size
+      /// @return Maximum compressed size
+      static uint32_t Bound(uint32_t len) {return len + (len / 255) + 16;}
+
+      /// @brief Compress the given buffer
+      /// @param[in] src - Raw buffer
+      /// @param[in] srcLen - Size of the raw buffer
+      /// @param[out] dst - Output buffer
+      /// @param[in] dstCap - Capacity of the output buffer
+      /// @return Compressed size, 0 when it does not fit in dstCap
+      static uint32_t Compress(const uint8_t* src, uint32_t srcLen, uint8_t* dst, uint32_t dstCap);
+
+      /// @brief Decompress the given buffer
+      /// @param[in] src - Compressed buffer
+      /// @param[in] srcLen - Size of the compressed buffer
+      /// @param[out] dst - Output buffer
+      /// @param[in] dstCap - Capacity of the output buffer
+      /// @return Decompressed size, -1 when the input is corrupted
+      static int32_t Decompress(const uint8_t* src, uint32_t srcLen, uint8_t* dst, uint32_t dstCap);
+
+      /// @brief Encode a block header
+      /// @param[out] hdr - Header buffer of HEADER_SIZE bytes
+      /// @param[in] rawLen - Raw size
+      /// @param[in] packedLen - Payload size
+      /// @return none
+      static void WriteHeader(uint8_t* hdr, uint32_t rawLen, uint32_t packedLen);
+
+      /// @brief Decode a block header
+      /// @param[in] hdr - Header buffer of HEADER_SIZE bytes
+      /// @param[out] rawLen - Raw size
+      /// @param[out] packedLen - Payload size
+      /// @return false when the magic does not match
+      static bool ReadHeader(const uint8_t* hdr, uint32_t &rawLen, uint32_t &packedLen);
 };
 
 /**
@@ -173,10 +301,31 @@ class TracerMedium
       /// @param[in] buf - Buffer to print
       /// @param[in] vaargs - Argument list
       /// @param[out] len - Size of the prepared buffer
+      /// @param[in] seq - Sequence number of the record
       /// @return Output buffer
-      const char* Prepare(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint32_t &len);
+      const char* Prepare(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint32_t &len, uint64_t seq);
+
+      /// @brief To add the sequence number to a record formatted without it
+      /// @param[out] out - Output string, the record is appended
+      /// @param[in] record - Record formatted by Format with seq 0
+      /// @param[in] len - Size of the record
+      /// @param[in] seq - Sequence number of the record
+      /// @return none
+      static void Number(string& out, const char* record, uint32_t len, uint64_t seq);
 
    public:
+      /// @brief To format the log data into the given buffer
+      /// @param[out] out - Output buffer
+      /// @param[in] size - Size of the output buffer
+      /// @param[in] type - Log level
+      /// @param[in] file - File name
+      /// @param[in] func - Function name
+      /// @param[in] buf - Buffer to print
+      /// @param[in] vaargs - Argument list
+      /// @param[in] seq - Sequence number of the record, 0 to leave it out
+      /// @return Length of the formatted record without the terminating null
+      static uint32_t Format(char* out, uint32_t size, Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs, uint64_t seq = 0);
+
       /// @brief Get the the singleton object
       /// @return Object/Instance of TracerMedium
       static TracerMedium* Instance();
@@ -190,19 +339,61 @@ class TracerMedium
       /// @param[in] func - Function name
       /// @param[in] buf - Buffer to print
       /// @param[in] vaargs - Argument list
+      /// @return Sequence number of the record
+      virtual uint64_t Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs) = 0;
+
+      /// @brief To write records formatted without sequence number which should be implemented in the Medium classes
+      /// @param[in] data - Records, each one terminated by a new line
+      /// @param[in] sizes - Size of each record
+      /// @param[in] records - Number of records
+      /// @return Sequence number of the last record
+      virtual uint64_t Write(const char* data, const uint32_t* sizes, uint32_t records) = 0;
+
+      /// @brief To wait until the records up to the given sequence number are written
+      /// @param[in] seq - Sequence number
       /// @return none
-      virtual void Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs) = 0;
+      virtual void Flush(uint64_t seq) = 0;
 
       /// @brief To get the location where the log is dumped
       /// @return location string
       virtual string Location() const = 0;
 
+      /// @brief To get the bytes written so far
+      /// @return byte count
+      uint64_t Written() const {return m_written;}
+
+      /// @brief To get the time spent by the medium outside of Print (background writers)
+      /// @return nanoseconds
+      uint64_t BusyTime() const {return m_busyTime;}
+
+      /// @brief To get the number of this medium instance, a new instance may reuse the address of a destroyed one
+      /// @return generation number
+      uint32_t Generation() const {return m_generation;}
+
+      /// @brief To get the bytes accepted but not yet written
+      /// @return byte count
+      virtual uint64_t Backlog() const {return 0;}
+
+      /// @brief To get the sequence number of the last record given to any medium
+      /// @return sequence number
+      static uint64_t Last();
+
       /// @brief To lock the buffer
       void Lock() {m_guard.lock();}
 
       /// @brief To unlock the buffer
       void Unlock() {m_guard.unlock();}
 
+   protected:
+      /// @brief To assign the sequence numbers of the records (lock must be held)
+      /// @param[in] records - Number of records
+      /// @return Sequence number of the last record
+      static uint64_t Stamp(uint32_t records = 1);
+
+      atomic<uint64_t>   m_written;   ///< Bytes written in the medium
+      atomic<uint64_t>   m_busyTime;  ///< Nanoseconds spent in background writers
+      const uint32_t     m_generation;  ///< Number of the instance
+
    private:
       mutex              m_guard;  ///< Instance for Guard
 };
@@ -225,8 +416,20 @@ class TracerMediumConsole : public TracerMedium
       /// @param[in] func - Function name
       /// @param[in] buf - Buffer to print
       /// @param[in] vaargs - Argument list
+      /// @return Sequence number of the record
+      uint64_t Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+
+      /// @brief To write records formatted without sequence number
+      /// @param[in] data - Records, each one terminated by a new line
+      /// @param[in] sizes - Size of each record
+      /// @param[in] records - Number of records
+      /// @return Sequence number of the last record
+      uint64_t Write(const char* data, const uint32_t* sizes, uint32_t records);
+
+      /// @brief To wait until the records up to the given sequence number are written
+      /// @param[in] seq - Sequence number
       /// @return none
-      void Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+      void Flush(uint64_t seq);
 
       /// @brief To get the location where the log is dumped
       /// @return location string
@@ -254,16 +457,58 @@ class TracerMediumFile : public TracerMedium
       /// @param[in] func - Function name
       /// @param[in] buf - Buffer to print
       /// @param[in] vaargs - Argument list
+      /// @return Sequence number of the record
+      uint64_t Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+
+      /// @brief To write records formatted without sequence number
+      /// @param[in] data - Records, each one terminated by a new line
+      /// @param[in] sizes - Size of each record
+      /// @param[in] records - Number of records
+      /// @return Sequence number of the last record
+      uint64_t Write(const char* data, const uint32_t* sizes, uint32_t records);
+
+      /// @brief To wait until the records up to the given sequence number are written
+      /// @param[in] seq - Sequence number
       /// @return none
-      void Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+      void Flush(uint64_t seq);
 
       /// @brief To get the location where the log is dumped
       /// @return location string
       string Location() const {return m_fileName;}
 
+      /// @brief To get the bytes queued for the compression thread
+      /// @return byte count
+      uint64_t Backlog() const {return m_backlog;}
+
    private:
-      FILE*     m_handle;
-      string    m_fileName;
+      /// @brief Background loop which compresses and writes the queued blocks
+      /// @return none
+      void Worker();
+
+      /// @brief Hand over the current block to the worker (lock must be held)
+      /// @return none
+      void Submit();
+
+      FILE*                m_handle;
+      string               m_fileName;
+      bool                 m_compress;    ///< Write compressed blocks
+      string               m_block;       ///< Block being filled
+      /// @brief A block waiting for the worker
+      struct Block {
+         string     data;      ///< Raw records
+         uint64_t   last;      ///< Sequence number of the last record
+      };
+
+      uint64_t             m_blockLast;   ///< Sequence number of the last record in m_block
+      deque<Block>         m_pending;     ///< Blocks waiting for the worker
+      mutex                m_queueGuard;  ///< Guard for m_pending and m_stop
+      condition_variable   m_signal;      ///< Wakes up the worker
+      bool                 m_stop;        ///< Worker should exit once drained
+      thread               m_worker;      ///< Compression thread
+      atomic<uint64_t>     m_backlog;     ///< Raw bytes in m_pending
+      uint64_t             m_durable;     ///< Records up to here are flushed (guarded by m_queueGuard when compressed)
+      atomic<uint64_t>     m_synced;      ///< Records up to here are synced to the disk
+      condition_variable   m_flushed;     ///< Wakes up the barriers when a block is written
 };
 
 /**
@@ -284,8 +529,20 @@ class TracerMediumNetwork : public TracerMedium
       /// @param[in] func - Function name
       /// @param[in] buf - Buffer to print
       /// @param[in] vaargs - Argument list
+      /// @return Sequence number of the record
+      uint64_t Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+
+      /// @brief To write records formatted without sequence number
+      /// @param[in] data - Records, each one terminated by a new line
+      /// @param[in] sizes - Size of each record
+      /// @param[in] records - Number of records
+      /// @return Sequence number of the last record
+      uint64_t Write(const char* data, const uint32_t* sizes, uint32_t records);
+
+      /// @brief To wait until the records up to the given sequence number are written
+      /// @param[in] seq - Sequence number
       /// @return none
-      void Print(Tracer::LogLevelEnum_t type, const char* file, const char* func, const char* buf, va_list vaargs);
+      void Flush(uint64_t seq);
 
       /// @brief To get the location where the log is dumped
       /// @return location string
@@ -6,7 +6,8 @@
 # ****************************************************************************
 
 declare -a CPPFILES=(	"Tracer.cpp"
-						"usage.cpp")
+						"usage.cpp"
+						"tracercat.cpp")
 
 prepareOutDir() {
 	rm -fr objs/*
@@ -14,16 +15,15 @@ prepareOutDir() {
 }
 
 cppCompile() {
-	OBJS=""
 	for i in "${CPPFILES[@]}"
 	do
 		INFILE=$i
 		OUTFILE=${i//.cpp/.o}
 		echo -e '\e[96m*** Compiling '$INFILE'\e[0m'
 		g++ $INFILE -c -o objs/$OUTFILE -I./ -std=c++11
-		OBJS=$OBJS" "objs/$OUTFILE
 	done
-	g++ -o objs/usage.exe $OBJS
+	g++ -o objs/usage.exe objs/Tracer.o objs/usage.o -pthread
+	g++ -o objs/tracercat.exe objs/Tracer.o objs/tracercat.o -pthread
 }
 
 prepareOutDir
@@ -0,0 +1,131 @@
+/*
+Copyright [2016] [ssundaramp@outlook.com]
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+  *
+  * @file tracercat.cpp
+  * @brief Decompress the block compressed log files (*.akz) to stdout
+  * @author Shunmuga (ssundaramp@outlook.com)
+  *
+  */
+
+#include <stdio.h>
+#include <vector>
+
+#include "Tracer.hpp"
+
+using namespace std;
+
+using namespace AKKU;
+
+/// @brief Move to the next block magic, after a damaged block
+/// @param[in] in - File positioned after the start of the damaged block
+/// @return false at the end of the file
+static bool _Resync(FILE* in)
+{
+    static const char magic[] = "AKZ1";
+    uint32_t matched = 0;
+    int c;
+
+    while (EOF != (c = fgetc(in))) {
+        if (c == magic[matched]) {
+            if (sizeof(magic) - 1 == ++matched) {
+                fseek(in, -static_cast<long>(matched), SEEK_CUR);
+                return true;
+            }
+        } else {
+            matched = (c == magic[0]) ? 1 : 0;
+        }
+    }
+    return false;
+}
+
+/// @brief Decompress every block of the given file to stdout, damaged blocks are skipped
+/// @param[in] name - File name
+/// @return 0 on success
+static int _Cat(const char* name)
+{
+    FILE* in = fopen(name, "rb");
+    if (!in) {
+        fprintf(stderr, "tracercat: cannot open %s\n", name);
+        return 1;
+    }
+
+    vector<uint8_t> packed;
+    vector<uint8_t> raw;
+    uint8_t hdr[Log::TracerCompressor::HEADER_SIZE];
+    uint32_t rawLen = 0, packedLen = 0;
+    long block = 0, start = 0;
+    int ret = 0;
+
+    for (;;) {
+        start = ftell(in);
+        if (sizeof(hdr) != fread(hdr, 1, sizeof(hdr), in)) break;
+        if (!Log::TracerCompressor::ReadHeader(hdr, rawLen, packedLen) || packedLen > rawLen
+            || rawLen > Log::TracerCompressor::MAX_BLOCK_SIZE) {
+            fprintf(stderr, "tracercat: %s: bad block header at offset %ld\n", name, start);
+            ret = 1;
+            fseek(in, start + 1, SEEK_SET);
+            if (!_Resync(in)) break;
+            continue;
+        }
+        packed.resize(packedLen);
+        if (packedLen != fread(packed.data(), 1, packedLen, in)) {
+            // A crashed writer leaves a partial block, the next run appends after it
+            fprintf(stderr, "tracercat: %s: truncated block at offset %ld\n", name, start);
+            ret = 1;
+            fseek(in, start + 1, SEEK_SET);
+            if (!_Resync(in)) break;
+            continue;
+        }
+        if (packedLen == rawLen) {
+            fwrite(packed.data(), 1, packedLen, stdout);
+        } else {
+            raw.resize(rawLen);
+            int32_t n = Log::TracerCompressor::Decompress(packed.data(), packedLen, raw.data(), rawLen);
+            if (n != static_cast<int32_t>(rawLen)) {
+                fprintf(stderr, "tracercat: %s: corrupted block %ld at offset %ld\n", name, block, start);
+                ret = 1;
+                fseek(in, start + 1, SEEK_SET);
+                if (!_Resync(in)) break;
+                continue;
+            }
+            fwrite(raw.data(), 1, rawLen, stdout);
+        }
+        ++block;
+    }
+
+    fclose(in);
+    return ret;
+}
+
+/// @brief Main entry
+/// @param[in] argc - argument count
+/// @param[in] argv - argument values
+/// @return error value
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file.akz>...\n", argv[0]);
+        return 2;
+    }
+
+    int ret = 0;
+    for (int it = 1; it < argc; ++it) {
+        ret |= _Cat(argv[it]);
+    }
+    return ret;
+}
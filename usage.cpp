@@ -40,6 +40,20 @@ static void _PrintSomething()
     tracer.NotImplemented("Printing as NotImplemented scope");
 }
 
+static void _Request(bool fail)
+{
+    Log::Tracer tracer(TRACER_ARGS);
+
+    tracer.Log("Handling the request");
+    {
+        Log::Tracer nested(TRACER_ARGS, false);
+        nested.Log("Nested scope of the request");
+    }
+    if (fail) {
+        tracer.Error("Request failed");
+    }
+}
+
 static void _HexDump(unsigned char columns)
 {
     Log::Tracer tracer(TRACER_ARGS);
@@ -78,6 +92,21 @@ int main(int argc, char** argv)
     cout << "\n*** Dumping HexaDecimal values as 32 columns\n";
     _HexDump(32);
 
+    Log::Tracer::SetLevel(Log::Tracer::LOG_LEVEL_ALL);
+    Log::Tracer::SetDeferred(true);
+    cout << "\n*** Calling _Request() in deferred mode without an error (nothing printed)\n";
+    _Request(false);
+
+    cout << "\n*** Calling _Request() in deferred mode with an error (whole context printed)\n";
+    _Request(true);
+    Log::Tracer::SetDeferred(false);
+
+    // Call trace and log levels are masked out while logging takes over 2% of the time or 64 KB/s
+    Log::Tracer::SetBudget(2.0, 64 * 1024);
+    cout << "\n*** Calling _PrintSomething() under a logging budget\n";
+    _PrintSomething();
+    Log::Tracer::SetBudget();
+
 
 
     // Logging in File
@@ -101,6 +130,21 @@ int main(int argc, char** argv)
     cout << "\n*** Dumping HexaDecimal values as 32 columns\n";
     _HexDump(32);
 
+
+
+    // Logging in compressed File (read it back with tracercat.exe)
+    Log::Tracer::SetCompression(true);
+
+    Log::Tracer::SetLevel(Log::Tracer::LOG_LEVEL_ALL);
+    cout << "\n*** Calling _PrintSomething() after enabling compression\n";
+    _PrintSomething();
+
+    // Flush only at the barrier and sync the file there
+    Log::Tracer::SetFlushPolicy(Log::Tracer::FLUSH_ON_BARRIER_SYNC);
+    cout << "\n*** Calling _PrintSomething() and waiting for the records on the disk\n";
+    _PrintSomething();
+    Log::Tracer::Flush();
+
     return 0;
 }
 
@@ -13,6 +13,9 @@ set FILES[0].obj=Tracer.obj
 set FILES[1].src=usage.cpp
 set FILES[1].obj=usage.obj
 
+set FILES[2].src=tracercat.cpp
+set FILES[2].obj=tracercat.obj
+
 rem ****************************************************************
 rem DON'T TOUCH THE BELOW PART UNTIL OTHERWISE YOU ARE FAMILIAR WITH
 rem THIS BUILD SYSTEM
@@ -28,13 +31,12 @@ md objs
 del /F /Q objs\*.exe
 del /F /Q objs\*.obj
 
-set "OBJS="
 for /l %%n in (0,1,%count%) do (
 	cl /c /EHsc %CD%\!FILES[%%n].src! /Foobjs/!FILES[%%n].obj! /I%CD%
-	SET OBJS=!OBJS! objs/!FILES[%%n].obj!
 )
 
-link /OUT:objs/usage.exe %OBJS%
+link /OUT:objs/usage.exe objs/Tracer.obj objs/usage.obj
+link /OUT:objs/tracercat.exe objs/Tracer.obj objs/tracercat.obj
 
 rem ****************************************************************
 